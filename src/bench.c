@@ -0,0 +1,219 @@
+/*
+ * Measure how libusbgetdev_context lookups scale with the number of
+ * reader threads.
+ *
+ * usage: bench [-r] [max_threads] [seconds]
+ *
+ * Every thread resolves the block and character device of each
+ * interface on the bus in a loop, the totals are printed for 1 up to
+ * max_threads threads. With -r another thread refreshes the context
+ * the whole time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusb.h"
+#include "libusbgetdev.h"
+
+struct lookup {
+	libusb_device *dev;
+	int iface;
+};
+
+struct reader {
+	pthread_t thread;
+	unsigned long long ops;
+};
+
+static struct libusbgetdev_context *ctx;
+static struct lookup *lookups;
+static size_t num_lookups;
+static atomic_int stop;
+
+static void *reader_thread(void *arg)
+{
+	struct reader *reader = arg;
+	unsigned long long ops = 0;
+	char *path;
+	size_t i;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (i = 0; i < num_lookups; i++) {
+			if (!libusbgetdev_context_get_blockdev_path(ctx,
+					lookups[i].dev, lookups[i].iface, &path))
+				free(path);
+			if (!libusbgetdev_context_get_chardev_path(ctx,
+					lookups[i].dev, lookups[i].iface, &path))
+				free(path);
+			ops += 2;
+		}
+	}
+
+	reader->ops = ops;
+	return NULL;
+}
+
+static void *refresh_thread(void *arg)
+{
+	unsigned long long *refreshes = arg;
+
+	while (!atomic_load(&stop)) {
+		if (!libusbgetdev_context_refresh(ctx))
+			(*refreshes)++;
+	}
+
+	return NULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int add_lookups(libusb_device **devs)
+{
+	uint8_t ifaces[UINT8_MAX + 1];
+	struct lookup *new_lookups;
+	libusb_device *dev;
+	int i, j, count;
+
+	for (i = 0; (dev = devs[i]) != NULL; i++) {
+		count = libusb_get_interface_numbers(dev, ifaces, sizeof(ifaces));
+		/* Still exercises the snapshot, the lookups just miss */
+		if (count <= 0) {
+			ifaces[0] = 0;
+			count = 1;
+		}
+
+		for (j = 0; j < count; j++) {
+			new_lookups = realloc(lookups,
+					      (num_lookups + 1) * sizeof(*lookups));
+			if (!new_lookups)
+				return LIBUSB_ERROR_NO_MEM;
+			lookups = new_lookups;
+			lookups[num_lookups].dev = dev;
+			lookups[num_lookups].iface = ifaces[j];
+			num_lookups++;
+		}
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static double run(struct reader *readers, int threads, double seconds,
+	int refresh, unsigned long long *total, unsigned long long *refreshes)
+{
+	struct timespec duration;
+	pthread_t refresher;
+	double start, elapsed;
+	int i;
+
+	atomic_store(&stop, 0);
+	*refreshes = 0;
+
+	start = now_sec();
+	for (i = 0; i < threads; i++)
+		pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i]);
+	if (refresh)
+		pthread_create(&refresher, NULL, refresh_thread, refreshes);
+
+	duration.tv_sec = (time_t)seconds;
+	duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1e9);
+	nanosleep(&duration, NULL);
+	atomic_store(&stop, 1);
+
+	*total = 0;
+	for (i = 0; i < threads; i++) {
+		pthread_join(readers[i].thread, NULL);
+		*total += readers[i].ops;
+	}
+	if (refresh)
+		pthread_join(refresher, NULL);
+	elapsed = now_sec() - start;
+
+	return *total / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long total, refreshes;
+	struct reader *readers;
+	libusb_device **devs;
+	double seconds = 1.0, rate, base = 0;
+	int r, i, max_threads, refresh = 0;
+	ssize_t cnt;
+
+	if (argc > 1 && !strcmp(argv[1], "-r")) {
+		refresh = 1;
+		argc--;
+		argv++;
+	}
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (argc > 2)
+		seconds = atof(argv[2]);
+	if (max_threads < 1 || seconds <= 0) {
+		fprintf(stderr, "usage: bench [-r] [max_threads] [seconds]\n");
+		return 1;
+	}
+
+	r = libusb_init(/*ctx=*/NULL);
+	if (r < 0)
+		return r;
+
+	cnt = libusb_get_device_list(NULL, &devs);
+	if (cnt < 0) {
+		libusb_exit(NULL);
+		return (int) cnt;
+	}
+
+	r = add_lookups(devs);
+	if (r == LIBUSB_SUCCESS && !num_lookups) {
+		fprintf(stderr, "no USB devices to look up\n");
+		r = LIBUSB_ERROR_NOT_FOUND;
+	}
+	if (r == LIBUSB_SUCCESS)
+		r = libusbgetdev_context_new(NULL, &ctx);
+
+	readers = calloc(max_threads, sizeof(*readers));
+	if (r == LIBUSB_SUCCESS && !readers)
+		r = LIBUSB_ERROR_NO_MEM;
+
+	if (r == LIBUSB_SUCCESS) {
+		printf("%zu lookups per pass%s\n", num_lookups * 2,
+		       refresh ? ", refreshing" : "");
+		printf("threads       lookups/s   speedup  efficiency%s\n",
+		       refresh ? "  refreshes" : "");
+
+		for (i = 1; i <= max_threads; i++) {
+			rate = run(readers, i, seconds, refresh, &total, &refreshes);
+			if (i == 1)
+				base = rate;
+
+			printf("%7d %15.0f %9.2f %10.0f%%", i, rate,
+			       rate / base, 100 * rate / base / i);
+			if (refresh)
+				printf(" %10llu", refreshes);
+			printf("\n");
+		}
+	}
+
+	libusbgetdev_context_free(ctx);
+	free(readers);
+	free(lookups);
+	libusb_free_device_list(devs, 1);
+	libusb_exit(NULL);
+
+	return r < 0 ? r : 0;
+}
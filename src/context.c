@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#include "libusb.h"
+#include "libusbgetdev.h"
+#include "libusbgetdevi.h"
+
+/* Number of reader counters per epoch, each on its own cache line */
+#define CTX_READER_SLOTS 16
+#define CTX_CACHE_LINE 64
+
+/*
+ * Identifies a device across refreshes. The address alone can be handed
+ * to another device after an unplug, the port path tells them apart.
+ */
+struct ctx_dev_key {
+	uint8_t bus;
+	uint8_t num_ports;
+	uint8_t ports[7];
+	uint8_t address;
+};
+
+struct ctx_entry {
+	struct ctx_dev_key dev;
+	uint8_t iface;
+	uint8_t dev_type;
+	char *path;
+};
+
+/*
+ * An immutable set of resolved paths, sorted by device, interface
+ * and device type.
+ * Devices that are in the snapshot but have no entry for an
+ * interface resolve to LIBUSB_ERROR_NOT_FOUND.
+ */
+struct ctx_snapshot {
+	size_t count;
+	struct ctx_entry *entries;
+	size_t num_devs;
+	struct ctx_dev_key *devs;
+	/* NULL on platforms without alias directories */
+	struct libusbgetdev_aliases *aliases;
+};
+
+struct ctx_reader_slot {
+	_Alignas(CTX_CACHE_LINE) atomic_long count;
+};
+
+/*
+ * The fields up to the reader slots are read by every lookup but only
+ * written by refreshes, they share a cache line that the slot counters
+ * stay clear of.
+ */
+struct libusbgetdev_context {
+	_Alignas(CTX_CACHE_LINE) _Atomic(struct ctx_snapshot *) snapshot;
+	atomic_ulong epoch;
+	atomic_flag updating;
+	libusb_context *usb_ctx;
+	char *dev_root;
+	struct ctx_reader_slot readers[2][CTX_READER_SLOTS];
+};
+
+static atomic_uint next_reader_slot;
+static _Thread_local int reader_slot = -1;
+
+static struct libusbgetdev_context *ctx_alloc(void)
+{
+	struct libusbgetdev_context *ctx;
+
+#ifdef _WIN32
+	ctx = _aligned_malloc(sizeof(*ctx), CTX_CACHE_LINE);
+#else
+	ctx = aligned_alloc(CTX_CACHE_LINE, sizeof(*ctx));
+#endif
+	if (ctx)
+		memset(ctx, 0, sizeof(*ctx));
+
+	return ctx;
+}
+
+static void ctx_release(struct libusbgetdev_context *ctx)
+{
+#ifdef _WIN32
+	_aligned_free(ctx);
+#else
+	free(ctx);
+#endif
+}
+
+static void ctx_yield(void)
+{
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static void free_snapshot(struct ctx_snapshot *snap)
+{
+	size_t i;
+
+	if (!snap)
+		return;
+
+	for (i = 0; i < snap->count; i++)
+		free(snap->entries[i].path);
+	free(snap->entries);
+	free(snap->devs);
+	libusbgetdev_aliases_free(snap->aliases);
+	free(snap);
+}
+
+static void get_dev_key(struct libusb_device *dev, struct ctx_dev_key *key)
+{
+	int ret;
+
+	memset(key, 0, sizeof(*key));
+	key->bus = libusb_get_bus_number(dev);
+	key->address = libusb_get_device_address(dev);
+
+	ret = libusb_get_port_numbers(dev, key->ports, sizeof(key->ports));
+	if (ret > 0)
+		key->num_ports = ret;
+}
+
+static int cmp_dev(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct ctx_dev_key));
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	const struct ctx_entry *ea = a, *eb = b;
+	int ret;
+
+	ret = cmp_dev(&ea->dev, &eb->dev);
+	if (ret)
+		return ret;
+	if (ea->iface != eb->iface)
+		return ea->iface - eb->iface;
+	return ea->dev_type - eb->dev_type;
+}
+
+static int add_entry(struct ctx_snapshot *snap, size_t *alloc,
+	struct libusb_device *dev, int iface, enum usbi_dev_type dev_type)
+{
+	struct ctx_entry *entry;
+	char *path;
+	int ret;
+
+	ret = get_dev_path(dev, iface, dev_type, &path);
+	if (ret == LIBUSB_ERROR_NO_MEM)
+		return ret;
+	if (ret != LIBUSB_SUCCESS)
+		return LIBUSB_SUCCESS;
+
+	if (snap->count == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 16;
+		entry = realloc(snap->entries, *alloc * sizeof(*entry));
+		if (!entry) {
+			free(path);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		snap->entries = entry;
+	}
+
+	entry = &snap->entries[snap->count++];
+	get_dev_key(dev, &entry->dev);
+	entry->iface = iface;
+	entry->dev_type = dev_type;
+	entry->path = path;
+
+	return LIBUSB_SUCCESS;
+}
+
+static int build_snapshot(libusb_context *usb_ctx, const char *dev_root,
+	struct ctx_snapshot **out)
+{
+	uint8_t ifaces[UINT8_MAX + 1];
+	struct ctx_snapshot *snap;
+	libusb_device **devs;
+	libusb_device *dev;
+	size_t alloc = 0;
+	ssize_t cnt;
+	int i, j, count, ret = LIBUSB_SUCCESS;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return LIBUSB_ERROR_NO_MEM;
+
+	cnt = libusb_get_device_list(usb_ctx, &devs);
+	if (cnt < 0) {
+		free(snap);
+		return (int) cnt;
+	}
+
+	snap->devs = malloc((cnt ? cnt : 1) * sizeof(*snap->devs));
+	if (!snap->devs) {
+		ret = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	for (i = 0; ret == LIBUSB_SUCCESS && (dev = devs[i]) != NULL; i++) {
+		count = get_iface_numbers(dev, ifaces, sizeof(ifaces));
+
+		for (j = 0; ret == LIBUSB_SUCCESS && j < count; j++) {
+			ret = add_entry(snap, &alloc, dev, ifaces[j], USBI_DEV_BLOCK);
+			if (ret == LIBUSB_SUCCESS)
+				ret = add_entry(snap, &alloc, dev, ifaces[j], USBI_DEV_CHAR);
+		}
+
+		get_dev_key(dev, &snap->devs[snap->num_devs++]);
+	}
+
+	qsort(snap->entries, snap->count, sizeof(*snap->entries), cmp_entry);
+	qsort(snap->devs, snap->num_devs, sizeof(*snap->devs), cmp_dev);
+
+	if (ret == LIBUSB_SUCCESS) {
+		ret = libusbgetdev_aliases_new(dev_root, &snap->aliases);
+		if (ret == LIBUSB_ERROR_NOT_SUPPORTED)
+			ret = LIBUSB_SUCCESS;
+	}
+
+out:
+	libusb_free_device_list(devs, 1);
+	if (ret != LIBUSB_SUCCESS) {
+		free_snapshot(snap);
+		return ret;
+	}
+
+	*out = snap;
+	return LIBUSB_SUCCESS;
+}
+
+static struct ctx_reader_slot *reader_enter(struct libusbgetdev_context *ctx)
+{
+	struct ctx_reader_slot *slot;
+	unsigned long epoch;
+
+	if (reader_slot < 0)
+		reader_slot = atomic_fetch_add(&next_reader_slot, 1) % CTX_READER_SLOTS;
+
+	/*
+	 * Register in the current epoch and make sure the epoch did not
+	 * move before the registration became visible to the updater.
+	 */
+	for (;;) {
+		epoch = atomic_load(&ctx->epoch);
+		slot = &ctx->readers[epoch & 1][reader_slot];
+		atomic_fetch_add(&slot->count, 1);
+		if (atomic_load(&ctx->epoch) == epoch)
+			return slot;
+		atomic_fetch_sub(&slot->count, 1);
+	}
+}
+
+static void reader_exit(struct ctx_reader_slot *slot)
+{
+	atomic_fetch_sub_explicit(&slot->count, 1, memory_order_release);
+}
+
+/* Wait for every reader that may still see the previous snapshot. */
+static void wait_for_readers(struct libusbgetdev_context *ctx)
+{
+	unsigned long epoch;
+	int i;
+
+	epoch = atomic_fetch_add(&ctx->epoch, 1);
+
+	for (i = 0; i < CTX_READER_SLOTS; i++) {
+		while (atomic_load(&ctx->readers[epoch & 1][i].count))
+			ctx_yield();
+	}
+}
+
+static int snapshot_lookup(const struct ctx_snapshot *snap,
+	struct libusb_device *dev, int iface, enum usbi_dev_type dev_type,
+	char **path)
+{
+	const struct ctx_entry *entry;
+	struct ctx_entry key;
+
+	if (iface < 0 || iface > UINT8_MAX)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	get_dev_key(dev, &key.dev);
+	key.iface = iface;
+	key.dev_type = dev_type;
+
+	entry = bsearch(&key, snap->entries, snap->count,
+			sizeof(*snap->entries), cmp_entry);
+	if (entry) {
+		*path = strdup(entry->path);
+		return *path ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_MEM;
+	}
+
+	if (bsearch(&key.dev, snap->devs, snap->num_devs,
+		    sizeof(*snap->devs), cmp_dev))
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* Not part of the snapshot */
+	return LIBUSB_ERROR_NO_DEVICE;
+}
+
+static int ctx_get_dev_path(struct libusbgetdev_context *ctx,
+	libusb_device *dev, int iface_idx, enum usbi_dev_type dev_type,
+	char **path)
+{
+	struct ctx_reader_slot *slot;
+	struct ctx_snapshot *snap;
+	int ret = LIBUSB_ERROR_NO_DEVICE;
+
+	*path = NULL;
+
+	slot = reader_enter(ctx);
+	snap = atomic_load(&ctx->snapshot);
+	if (snap)
+		ret = snapshot_lookup(snap, dev, iface_idx, dev_type, path);
+	reader_exit(slot);
+
+	if (ret != LIBUSB_ERROR_NO_DEVICE)
+		return ret;
+
+	/* The device showed up after the last refresh, resolve it directly. */
+	if (dev_type == USBI_DEV_BLOCK)
+		return libusb_get_blockdev_path(dev, iface_idx, path);
+	return libusb_get_chardev_path(dev, iface_idx, path);
+}
+
+/** \ingroup libusb_misc
+ * Create a context that caches the block and character device paths
+ * of every USB device.
+ * The context starts out with a snapshot of the devices present when
+ * it is created, call libusbgetdev_context_refresh() to pick up changes.
+ *
+ * \param usb_ctx the libusb context used to list devices, or NULL for the
+ * default context
+ * \param ctx output location for the new context
+ * \returns 0 on success
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_context_new(libusb_context *usb_ctx,
+	struct libusbgetdev_context **ctx)
+{
+	struct libusbgetdev_context *new_ctx;
+	int ret;
+
+	new_ctx = ctx_alloc();
+	if (!new_ctx)
+		return LIBUSB_ERROR_NO_MEM;
+
+	new_ctx->usb_ctx = usb_ctx;
+	atomic_init(&new_ctx->snapshot, NULL);
+	atomic_init(&new_ctx->epoch, 0);
+	atomic_flag_clear(&new_ctx->updating);
+
+	ret = libusbgetdev_context_refresh(new_ctx);
+	if (ret < 0) {
+		ctx_release(new_ctx);
+		return ret;
+	}
+
+	*ctx = new_ctx;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_misc
+ * Free a context created by libusbgetdev_context_new().
+ * No other thread may use the context once this is called.
+ *
+ * \param ctx the context to free, may be NULL
+ */
+void libusbgetdev_context_free(struct libusbgetdev_context *ctx)
+{
+	if (!ctx)
+		return;
+
+	free_snapshot(atomic_load(&ctx->snapshot));
+	free(ctx->dev_root);
+	ctx_release(ctx);
+}
+
+/** \ingroup libusb_misc
+ * Resolve every device again and publish the result as the new snapshot.
+ * Lookups running on other threads are not blocked, they keep using the
+ * previous snapshot until they return. Only one refresh may run at a time.
+ *
+ * \param ctx the context
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY another thread is refreshing the context
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_context_refresh(struct libusbgetdev_context *ctx)
+{
+	struct ctx_snapshot *snap, *old;
+	int ret;
+
+	if (atomic_flag_test_and_set(&ctx->updating))
+		return LIBUSB_ERROR_BUSY;
+
+	ret = build_snapshot(ctx->usb_ctx, ctx->dev_root, &snap);
+	if (ret == LIBUSB_SUCCESS) {
+		old = atomic_exchange(&ctx->snapshot, snap);
+		if (old) {
+			wait_for_readers(ctx);
+			free_snapshot(old);
+		}
+	}
+
+	atomic_flag_clear(&ctx->updating);
+	return ret;
+}
+
+/** \ingroup libusb_misc
+ * Get the block device path of USB resource from the context snapshot.
+ * Safe to call from any number of threads, including while the context
+ * is being refreshed. Devices that are not in the snapshot are resolved
+ * with libusb_get_blockdev_path().
+ *
+ * \param ctx the context
+ * \param dev a device
+ * \param iface_idx the <tt>bInterfaceNumber</tt> of the interface you wish to probe
+ * \param path pointer to an allocated string that will contain the block device path
+ * if the function is successful, or NULL on error
+ * \note The caller is responsible for freeing the string.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND the device doesn't have an associated device
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_context_get_blockdev_path(struct libusbgetdev_context *ctx,
+	libusb_device *dev, int iface_idx, char **path)
+{
+	return ctx_get_dev_path(ctx, dev, iface_idx, USBI_DEV_BLOCK, path);
+}
+
+/** \ingroup libusb_misc
+ * Get the character device path of USB resource from the context snapshot.
+ * Safe to call from any number of threads, including while the context
+ * is being refreshed. Devices that are not in the snapshot are resolved
+ * with libusb_get_chardev_path().
+ *
+ * \param ctx the context
+ * \param dev a device
+ * \param iface_idx the <tt>bInterfaceNumber</tt> of the interface you wish to probe
+ * \param path pointer to an allocated string that will contain the character device path
+ * if the function is successful, or NULL on error
+ * \note The caller is responsible for freeing the string.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND the device doesn't have an associated device
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_context_get_chardev_path(struct libusbgetdev_context *ctx,
+	libusb_device *dev, int iface_idx, char **path)
+{
+	return ctx_get_dev_path(ctx, dev, iface_idx, USBI_DEV_CHAR, path);
+}
+
+/** \ingroup libusb_misc
+ * Set the directory used in place of `/dev` when looking for stable
+ * device names. Takes effect on the next libusbgetdev_context_refresh().
+ *
+ * \param ctx the context
+ * \param dev_root the directory, or NULL for `/dev`
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY another thread is refreshing the context
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_context_set_dev_root(struct libusbgetdev_context *ctx,
+	const char *dev_root)
+{
+	char *new_root = NULL;
+
+	if (dev_root) {
+		new_root = strdup(dev_root);
+		if (!new_root)
+			return LIBUSB_ERROR_NO_MEM;
+	}
+
+	if (atomic_flag_test_and_set(&ctx->updating)) {
+		free(new_root);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	free(ctx->dev_root);
+	ctx->dev_root = new_root;
+
+	atomic_flag_clear(&ctx->updating);
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_misc
+ * Get the stable names of a device node from the context snapshot,
+ * such as the `/dev/disk/by-id` and `/dev/serial/by-path` links.
+ * Safe to call from any number of threads, including while the context
+ * is being refreshed.
+ *
+ * \param ctx the context
+ * \param devnode the device node, as returned by
+ * libusbgetdev_context_get_blockdev_path() or
+ * libusbgetdev_context_get_chardev_path()
+ * \param aliases pointer to an allocated, NULL terminated array of paths
+ * if the function is successful, or NULL on error
+ * \note The caller is responsible for freeing the array with
+ * libusbgetdev_free_dev_aliases().
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND the device node has no aliases
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_context_get_dev_aliases(struct libusbgetdev_context *ctx,
+	const char *devnode, char ***aliases)
+{
+	struct ctx_reader_slot *slot;
+	struct ctx_snapshot *snap;
+	const char *const *names;
+	size_t i, count = 0;
+	int ret = LIBUSB_ERROR_NOT_FOUND;
+
+	*aliases = NULL;
+
+	slot = reader_enter(ctx);
+	snap = atomic_load(&ctx->snapshot);
+	if (snap && snap->aliases)
+		ret = libusbgetdev_aliases_lookup(snap->aliases, devnode,
+						  &names, &count);
+
+	if (ret == LIBUSB_SUCCESS) {
+		*aliases = calloc(count + 1, sizeof(**aliases));
+		for (i = 0; *aliases && i < count; i++) {
+			(*aliases)[i] = strdup(names[i]);
+			if (!(*aliases)[i]) {
+				libusbgetdev_free_dev_aliases(*aliases);
+				*aliases = NULL;
+			}
+		}
+		if (!*aliases)
+			ret = LIBUSB_ERROR_NO_MEM;
+	}
+	reader_exit(slot);
+
+	return ret;
+}
+
+/** \ingroup libusb_misc
+ * Free an array returned by libusbgetdev_context_get_dev_aliases().
+ *
+ * \param aliases the array to free, may be NULL
+ */
+void libusbgetdev_free_dev_aliases(char **aliases)
+{
+	size_t i;
+
+	if (!aliases)
+		return;
+
+	for (i = 0; aliases[i]; i++)
+		free(aliases[i]);
+	free(aliases);
+}
@@ -201,3 +201,23 @@ int get_dev_path(struct libusb_device *dev, int iface_idx,
 
 	return LIBUSB_ERROR_NOT_FOUND;
 }
+
+int get_dev_aliases(const char *dev_root, struct usbi_alias **aliases,
+	size_t *count) {
+	(void)dev_root;
+
+	*aliases = NULL;
+	*count = 0;
+
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int get_iface_numbers(struct libusb_device *dev, uint8_t *ifaces, int len) {
+	return usbi_get_iface_numbers_from_config (dev, ifaces, len);
+}
+
+int set_sysfs_root(const char *sysfs_root) {
+	(void)sysfs_root;
+
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "libusb.h"
 #include "libusbgetdev.h"
@@ -7,7 +8,7 @@
 /** \ingroup libusb_misc
  * Get the block device path of USB resource.
  * A string that contains a block device that is associated
- * with the USB resource using the active config descriptor.
+ * with the USB resource using the active configuration.
  * An example path on *nix is `/dev/sdaX`
  *
  * \param dev a device
@@ -21,18 +22,9 @@
  */
 int libusb_get_blockdev_path(libusb_device *dev, int iface_idx, char **path)
 {
-	struct libusb_config_descriptor *config;
-	int r;
-
 	*path = NULL;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		fprintf(stderr, "could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	if (iface_idx >= config->bNumInterfaces)
+	if (iface_idx < 0 || iface_idx > UINT8_MAX)
 		return LIBUSB_ERROR_NOT_FOUND;
 
 	return get_dev_path(dev, iface_idx, USBI_DEV_BLOCK, path);
@@ -41,7 +33,7 @@ int libusb_get_blockdev_path(libusb_device *dev, int iface_idx, char **path)
 /** \ingroup libusb_misc
  * Get the character device path of USB resource.
  * A string that contains a character device that is associated
- * with the USB resource using the active config descriptor.
+ * with the USB resource using the active configuration.
  * An example path on *nix is `/dev/ttyX`
  *
  * \param dev a device
@@ -55,19 +47,230 @@ int libusb_get_blockdev_path(libusb_device *dev, int iface_idx, char **path)
  */
 int libusb_get_chardev_path(libusb_device *dev, int iface_idx, char **path)
 {
-	struct libusb_config_descriptor *config;
-	int r;
-
 	*path = NULL;
 
+	if (iface_idx < 0 || iface_idx > UINT8_MAX)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return get_dev_path(dev, iface_idx, USBI_DEV_CHAR, path);
+}
+
+static int cmp_iface(const void *a, const void *b)
+{
+	return *(const uint8_t *)a - *(const uint8_t *)b;
+}
+
+void usbi_sort_iface_numbers(uint8_t *ifaces, int count)
+{
+	qsort(ifaces, count, sizeof(*ifaces), cmp_iface);
+}
+
+/*
+ * Fallback for platforms that can't list interfaces without the
+ * active config descriptor.
+ */
+int usbi_get_iface_numbers_from_config(struct libusb_device *dev,
+	uint8_t *ifaces, int len)
+{
+	struct libusb_config_descriptor *config;
+	int i, r, count = 0;
+
 	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		fprintf(stderr, "could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		if (config->interface[i].num_altsetting < 1)
+			continue;
+
+		if (count == len) {
+			count = LIBUSB_ERROR_OVERFLOW;
+			break;
+		}
+		ifaces[count++] = config->interface[i].altsetting[0].bInterfaceNumber;
+	}
+
+	libusb_free_config_descriptor(config);
+
+	if (count > 0)
+		usbi_sort_iface_numbers(ifaces, count);
+
+	return count;
+}
+
+/** \ingroup libusb_misc
+ * Get the <tt>bInterfaceNumber</tt> of every interface of the active
+ * configuration, in ascending order. The numbers don't have to be
+ * contiguous. On Linux they are read from sysfs without parsing
+ * the config descriptor.
+ *
+ * \param dev a device
+ * \param ifaces the array that should contain the interface numbers
+ * \param ifaces_len the maximum length of the array
+ * \returns the number of elements filled
+ * \returns \ref LIBUSB_ERROR_OVERFLOW if the array is too small
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusb_get_interface_numbers(libusb_device *dev, uint8_t *ifaces,
+	int ifaces_len)
+{
+	return get_iface_numbers(dev, ifaces, ifaces_len);
+}
+
+/** \ingroup libusb_misc
+ * Set the directory used in place of `/sys` when resolving devices,
+ * for running against a fixture tree.
+ * Not thread safe, call it before any lookup. Only supported on Linux.
+ *
+ * \param sysfs_root the directory, or NULL for `/sys`
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND the directory doesn't exist
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED on platforms without sysfs
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_set_sysfs_root(const char *sysfs_root)
+{
+	return set_sysfs_root(sysfs_root);
+}
+
+struct libusbgetdev_aliases {
+	size_t count;
+	/* Sorted by target, then by alias */
+	struct usbi_alias *entries;
+	/* The aliases in the same order, so that lookups return a slice */
+	const char **names;
+	char *dev_root;
+};
+
+static int cmp_alias(const void *a, const void *b)
+{
+	const struct usbi_alias *aa = a, *ab = b;
+	int ret;
+
+	ret = strcmp(aa->target, ab->target);
+	if (ret)
+		return ret;
+	return strcmp(aa->alias, ab->alias);
+}
+
+/** \ingroup libusb_misc
+ * Build a map from device nodes to their stable names.
+ * Every symlink under `/dev/disk/by-*` and `/dev/serial/by-*` is read
+ * once, after which lookups don't touch the filesystem.
+ * Only supported on Linux.
+ *
+ * \param dev_root the directory to use in place of `/dev`, or NULL
+ * \param aliases output location for the new map
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED on platforms without alias directories
+ * \returns another LIBUSB_ERROR code on error
+ */
+int libusbgetdev_aliases_new(const char *dev_root,
+	struct libusbgetdev_aliases **aliases)
+{
+	struct libusbgetdev_aliases *map;
+	size_t i;
+	int ret;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return LIBUSB_ERROR_NO_MEM;
+
+	map->dev_root = strdup(dev_root ? dev_root : "/dev");
+	if (!map->dev_root) {
+		free(map);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	ret = get_dev_aliases(map->dev_root, &map->entries, &map->count);
+	if (ret < 0) {
+		libusbgetdev_aliases_free(map);
+		return ret;
 	}
 
-	if (iface_idx >= config->bNumInterfaces)
+	qsort(map->entries, map->count, sizeof(*map->entries), cmp_alias);
+
+	map->names = malloc((map->count ? map->count : 1) * sizeof(*map->names));
+	if (!map->names) {
+		libusbgetdev_aliases_free(map);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < map->count; i++)
+		map->names[i] = map->entries[i].alias;
+
+	*aliases = map;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_misc
+ * Free a map created by libusbgetdev_aliases_new().
+ *
+ * \param aliases the map to free, may be NULL
+ */
+void libusbgetdev_aliases_free(struct libusbgetdev_aliases *aliases)
+{
+	size_t i;
+
+	if (!aliases)
+		return;
+
+	for (i = 0; i < aliases->count; i++) {
+		free(aliases->entries[i].target);
+		free(aliases->entries[i].alias);
+	}
+	free(aliases->entries);
+	free(aliases->names);
+	free(aliases->dev_root);
+	free(aliases);
+}
+
+/** \ingroup libusb_misc
+ * Get the stable names of a device node.
+ * An example for `/dev/sda1` is `/dev/disk/by-id/usb-Foo_Bar_1234-0:0-part1`
+ *
+ * \param aliases the map
+ * \param devnode the device node, as returned by libusb_get_blockdev_path()
+ * or libusb_get_chardev_path()
+ * \param names set to the aliases of the device node, sorted. They belong to the
+ * map and stay valid until it is freed.
+ * \param count set to the number of aliases
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND the device node has no aliases
+ */
+int libusbgetdev_aliases_lookup(const struct libusbgetdev_aliases *aliases,
+	const char *devnode, const char *const **names, size_t *count)
+{
+	size_t lo = 0, hi = aliases->count, first, root_len;
+
+	*names = NULL;
+	*count = 0;
+
+	/* Device nodes are matched relative to the /dev root */
+	root_len = strlen(aliases->dev_root);
+	if (!strncmp(devnode, aliases->dev_root, root_len) && devnode[root_len] == '/')
+		devnode += root_len + 1;
+	else if (!strncmp(devnode, "/dev/", 5))
+		devnode += 5;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp(aliases->entries[mid].target, devnode) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	first = lo;
+	while (lo < aliases->count && !strcmp(aliases->entries[lo].target, devnode))
+		lo++;
+
+	if (lo == first)
 		return LIBUSB_ERROR_NOT_FOUND;
 
-	return get_dev_path(dev, iface_idx, USBI_DEV_CHAR, path);
+	*names = &aliases->names[first];
+	*count = lo - first;
+
+	return LIBUSB_SUCCESS;
 }
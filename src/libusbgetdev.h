@@ -6,5 +6,33 @@
 
 int libusb_get_blockdev_path(libusb_device *dev, int iface_idx, char **path);
 int libusb_get_chardev_path(libusb_device *dev, int iface_idx, char **path);
+int libusb_get_interface_numbers(libusb_device *dev, uint8_t *ifaces,
+	int ifaces_len);
+
+int libusbgetdev_set_sysfs_root(const char *sysfs_root);
+
+struct libusbgetdev_aliases;
+
+int libusbgetdev_aliases_new(const char *dev_root,
+	struct libusbgetdev_aliases **aliases);
+void libusbgetdev_aliases_free(struct libusbgetdev_aliases *aliases);
+int libusbgetdev_aliases_lookup(const struct libusbgetdev_aliases *aliases,
+	const char *devnode, const char *const **names, size_t *count);
+
+struct libusbgetdev_context;
+
+int libusbgetdev_context_new(libusb_context *usb_ctx,
+	struct libusbgetdev_context **ctx);
+void libusbgetdev_context_free(struct libusbgetdev_context *ctx);
+int libusbgetdev_context_refresh(struct libusbgetdev_context *ctx);
+int libusbgetdev_context_get_blockdev_path(struct libusbgetdev_context *ctx,
+	libusb_device *dev, int iface_idx, char **path);
+int libusbgetdev_context_get_chardev_path(struct libusbgetdev_context *ctx,
+	libusb_device *dev, int iface_idx, char **path);
+int libusbgetdev_context_set_dev_root(struct libusbgetdev_context *ctx,
+	const char *dev_root);
+int libusbgetdev_context_get_dev_aliases(struct libusbgetdev_context *ctx,
+	const char *devnode, char ***aliases);
+void libusbgetdev_free_dev_aliases(char **aliases);
 
 #endif /* !LIBUSBGETDEV_H */
@@ -5,12 +5,33 @@
 #include "libusb.h"
 #include "libusbgetdev.h"
 
+/* Walks of the sysfs tree when entries vanished from under a lookup */
+#define SYSFS_WALK_RETRIES 3
+
 enum usbi_dev_type {
 	USBI_DEV_BLOCK = 1,
 	USBI_DEV_CHAR = 2,
 };
 
+struct usbi_alias {
+	/* Device node relative to the /dev root, e.g. `sda1` */
+	char *target;
+	/* Full path of the symlink, e.g. `/dev/disk/by-id/usb-...` */
+	char *alias;
+};
+
 int get_dev_path(struct libusb_device *dev, int iface_idx,
 	enum usbi_dev_type dev_type, char **path);
+int get_dev_aliases(const char *dev_root, struct usbi_alias **aliases,
+	size_t *count);
+int get_iface_numbers(struct libusb_device *dev, uint8_t *ifaces, int len);
+int set_sysfs_root(const char *sysfs_root);
+
+/* Linux only, resolves an interface of the sysfs device `sysfs_dir` */
+int get_dev_path_by_name(const char *sysfs_dir, int iface_idx,
+	enum usbi_dev_type dev_type, int walks, char **path);
+int usbi_get_iface_numbers_from_config(struct libusb_device *dev,
+	uint8_t *ifaces, int len);
+void usbi_sort_iface_numbers(uint8_t *ifaces, int count);
 
 #endif /* !LIBUSBGETDEVI_H */
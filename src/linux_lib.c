@@ -4,6 +4,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <dirent.h>
 
@@ -11,11 +15,135 @@
 #include "libusbgetdev.h"
 #include "libusbgetdevi.h"
 
-#define SYSFS_DEVICE_PATH "/sys/bus/usb/devices"
+#define SYSFS_ROOT "/sys"
+#define SYSFS_DEVICE_PATH "/bus/usb/devices"
+#define SYSFS_CLASS_BLOCK "/class/block"
+#define SYSFS_CLASS_TTY "/class/tty"
+#define SYSFS_UEVENT_SEQNUM "/kernel/uevent_seqnum"
+#define DEV_ROOT "/dev"
+
+/*
+ * Paths below the sysfs root, rebuilt by set_sysfs_root().
+ * The class directories are compared against the resolved `subsystem`
+ * links, so they are built from the canonical root.
+ */
+static struct {
+	char devices[PATH_MAX];
+	char block[PATH_MAX];
+	char tty[PATH_MAX];
+	char uevent_seqnum[PATH_MAX];
+} sysfs = {
+	SYSFS_ROOT SYSFS_DEVICE_PATH,
+	SYSFS_ROOT SYSFS_CLASS_BLOCK,
+	SYSFS_ROOT SYSFS_CLASS_TTY,
+	SYSFS_ROOT SYSFS_UEVENT_SEQNUM,
+};
+
+/* Number of interfaces remembered as not having a device node */
+#define NEG_CACHE_SIZE 64
+
+/*
+ * Interfaces whose walk came back with LIBUSB_ERROR_NOT_FOUND.
+ * The kernel bumps the uevent sequence number whenever a device is
+ * added, removed, bound or unbound, so an entry stays valid for as
+ * long as the sequence number it was stored with is current.
+ */
+struct neg_cache_entry {
+	char *dir;
+	const char *subsystem;
+	unsigned long long seqnum;
+};
+
+static struct neg_cache_entry neg_cache[NEG_CACHE_SIZE];
+static pthread_mutex_t neg_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Read a decimal sysfs attribute.
+ * Returns LIBUSB_ERROR_NOT_FOUND if the attribute is empty.
+ */
+static int read_sysfs_ull(const char *path, unsigned long long *val)
+{
+	char buf[32], *end;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? LIBUSB_ERROR_NOT_FOUND : LIBUSB_ERROR_IO;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return LIBUSB_ERROR_IO;
+
+	buf[len] = '\0';
+	*val = strtoull(buf, &end, 10);
+	if (end == buf)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return LIBUSB_SUCCESS;
+}
+
+static int read_uevent_seqnum(unsigned long long *seqnum)
+{
+	return read_sysfs_ull(sysfs.uevent_seqnum, seqnum);
+}
+
+static struct neg_cache_entry *neg_cache_slot(const char *dir,
+	const char *subsystem)
+{
+	unsigned int hash = 5381;
+	const char *c;
+
+	for (c = dir; *c; c++)
+		hash = hash * 33 + (unsigned char)*c;
+	for (c = subsystem; *c; c++)
+		hash = hash * 33 + (unsigned char)*c;
+
+	return &neg_cache[hash % NEG_CACHE_SIZE];
+}
+
+/*
+ * Returns 1 if the interface is known not to have a device node
+ * of the given subsystem.
+ */
+static int neg_cache_lookup(const char *dir, const char *subsystem,
+	unsigned long long seqnum)
+{
+	struct neg_cache_entry *entry;
+	int ret;
+
+	pthread_mutex_lock(&neg_cache_lock);
+	entry = neg_cache_slot(dir, subsystem);
+	ret = entry->dir && entry->seqnum == seqnum &&
+	      !strcmp(entry->subsystem, subsystem) && !strcmp(entry->dir, dir);
+	pthread_mutex_unlock(&neg_cache_lock);
+
+	return ret;
+}
+
+static void neg_cache_store(const char *dir, const char *subsystem,
+	unsigned long long seqnum)
+{
+	struct neg_cache_entry *entry;
+	char *dir_copy;
+
+	dir_copy = strdup(dir);
+	if (!dir_copy)
+		return;
+
+	pthread_mutex_lock(&neg_cache_lock);
+	entry = neg_cache_slot(dir, subsystem);
+	free(entry->dir);
+	entry->dir = dir_copy;
+	entry->subsystem = subsystem;
+	entry->seqnum = seqnum;
+	pthread_mutex_unlock(&neg_cache_lock);
+}
 
 /*
  * Check if a sysfs directory matches the given subsystem.
- * Subsystem being `/sys/class/.*`
+ * Subsystem being `<sysfs root>/class/.*`
  * Returns 0 if the subsystem matches
  * Returns 1 if the subsystem does not match
  * Returns LIBUSB_ERROR code on error
@@ -31,7 +159,7 @@ static int check_subsystem(const char *sys_path, const char* subsystem)
 
 	subsystem_path = realpath(path, NULL);
 	free(path);
-	if (!subsystem_path && errno != ENOENT)
+	if (!subsystem_path && errno != ENOENT && errno != ENOTDIR)
 		return LIBUSB_ERROR_IO;
 
 	if (subsystem_path) {
@@ -44,8 +172,13 @@ static int check_subsystem(const char *sys_path, const char* subsystem)
 	return ret;
 }
 
+/*
+ * Entries can disappear while the tree is walked when a device is
+ * unplugged or rebound. They are skipped and counted in `vanished`
+ * instead of failing the whole lookup.
+ */
 static int get_subsytem(char **buf,
-	const char *dir, const char* subsystem, int depth)
+	const char *dir, const char* subsystem, int depth, int *vanished)
 {
 	DIR *dp;
 	struct dirent *entry;
@@ -75,6 +208,10 @@ static int get_subsytem(char **buf,
 	ret = LIBUSB_ERROR_NOT_FOUND;
 
 	if ((dp = opendir(dir)) == NULL) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			(*vanished)++;
+			return LIBUSB_ERROR_NOT_FOUND;
+		}
 		fprintf(stderr, "opendir devices failed, errno=%d", errno);
 		return LIBUSB_ERROR_IO;
 	}
@@ -91,7 +228,12 @@ static int get_subsytem(char **buf,
 		}
 
 		ret = lstat(path, &statbuf);
-		if (ret < 0) {
+		if (ret < 0 && errno == ENOENT) {
+			free(path);
+			(*vanished)++;
+			ret = LIBUSB_ERROR_NOT_FOUND;
+			continue;
+		} else if (ret < 0) {
 			free(path);
 			ret = LIBUSB_ERROR_IO;
 			break;
@@ -99,7 +241,7 @@ static int get_subsytem(char **buf,
 
 		ret = LIBUSB_ERROR_NOT_FOUND;
 		if (S_ISDIR(statbuf.st_mode))
-			ret = get_subsytem(buf, path, subsystem, depth + 1);
+			ret = get_subsytem(buf, path, subsystem, depth + 1, vanished);
 		free(path);
 
 		if (ret != LIBUSB_ERROR_NOT_FOUND)
@@ -118,8 +260,10 @@ static int get_sysfs_dir(struct libusb_device *dev, char **path)
 #else
 static int get_sysfs_dir(struct libusb_device *dev, char **path)
 {
-	int ret;
+	/* "255-" plus up to 7 ports of "255." */
+	char name[4 + 7 * 4];
 	uint8_t port_path[8];
+	int i, len, ret;
 
 	ret = libusb_get_port_numbers(dev, port_path, sizeof(port_path));
 	if (ret < 0)
@@ -127,55 +271,426 @@ static int get_sysfs_dir(struct libusb_device *dev, char **path)
 	else if (ret == 0)
 		return LIBUSB_ERROR_NOT_FOUND;
 
-	/* If r is >1 does that mean it is a HUB? */
-	ret = asprintf(path, "%d-%d", libusb_get_bus_number(dev), port_path[0]);
-	if (ret < 0)
+	/* Devices behind hubs are named after the whole path, e.g. 1-2.3.1 */
+	len = snprintf(name, sizeof(name), "%d-%d", libusb_get_bus_number(dev),
+		       port_path[0]);
+	for (i = 1; i < ret; i++)
+		len += snprintf(name + len, sizeof(name) - len, ".%d", port_path[i]);
+
+	*path = strdup(name);
+	if (!*path)
 		return LIBUSB_ERROR_NO_MEM;
 
 	return LIBUSB_SUCCESS;
 }
 #endif
 
-int get_dev_path(struct libusb_device *dev, int iface_idx,
-	enum usbi_dev_type dev_type, char **path)
+/*
+ * Get the sysfs name of a device, e.g. `1-2.3`.
+ * Returns LIBUSB_ERROR_NOT_FOUND for root hubs, their interfaces
+ * don't have block or character devices.
+ */
+static int get_sysfs_name(struct libusb_device *dev, char **name)
+{
+	if (get_sysfs_dir(dev, name) != LIBUSB_SUCCESS)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* root hub? */
+	if (!strchr(*name, '-')) {
+		free(*name);
+		*name = NULL;
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+/*
+ * Returns LIBUSB_ERROR_NOT_FOUND if the device is unconfigured.
+ */
+static int get_active_config(const char *sysfs_dir, int *active_config)
 {
-	int ret, active_config;
-	char *sysfs_dir, *dir;
+	unsigned long long config;
+	char *path;
+	int ret;
+
+	ret = asprintf(&path, "%s/%s/bConfigurationValue", sysfs.devices,
+		       sysfs_dir);
+	if (ret < 0)
+		return LIBUSB_ERROR_NO_MEM;
+
+	ret = read_sysfs_ull(path, &config);
+	free(path);
+	if (ret < 0)
+		return ret;
+
+	*active_config = config;
+	return LIBUSB_SUCCESS;
+}
 
-	active_config = 1;
 /*
-	ret = sysfs_get_active_config(dev, &active_config);
+ * The interfaces of the active configuration are the only ones with a
+ * `<dev>:<config>.<interface>` entry, so a single readdir of the device
+ * directory lists them without touching the descriptors.
+ */
+int get_iface_numbers(struct libusb_device *dev, uint8_t *ifaces, int len)
+{
+	struct dirent *entry;
+	unsigned long iface;
+	char *sysfs_dir, *dir, *end;
+	size_t name_len;
+	DIR *dp;
+	int ret, count = 0;
+
+	ret = get_sysfs_name(dev, &sysfs_dir);
 	if (ret < 0)
 		return ret;
 
-	if (active_config == -1) {
-		fprintf(stderr, "device unconfigured");
-		return LIBUSB_ERROR_NOT_FOUND;
+	ret = asprintf(&dir, "%s/%s", sysfs.devices, sysfs_dir);
+	if (ret < 0) {
+		free(sysfs_dir);
+		return LIBUSB_ERROR_NO_MEM;
 	}
-*/
-
-	if (get_sysfs_dir(dev, &sysfs_dir) != LIBUSB_SUCCESS)
-		return LIBUSB_ERROR_NOT_FOUND;
 
-	/* root hub? */
-	if (!strchr(sysfs_dir, '-')) {
+	dp = opendir(dir);
+	free(dir);
+	if (!dp) {
 		free(sysfs_dir);
-		return LIBUSB_ERROR_NOT_FOUND;
+		return errno == ENOENT ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
 	}
 
-	ret = asprintf(&dir, SYSFS_DEVICE_PATH "/%s:%d.%d", sysfs_dir,
-		       active_config, iface_idx);
+	name_len = strlen(sysfs_dir);
+	while ((entry = readdir(dp)) != NULL) {
+		if (strncmp(entry->d_name, sysfs_dir, name_len) ||
+		    entry->d_name[name_len] != ':')
+			continue;
+
+		end = strchr(entry->d_name + name_len + 1, '.');
+		if (!end)
+			continue;
+
+		iface = strtoul(end + 1, &end, 10);
+		if (*end || iface > UINT8_MAX)
+			continue;
+
+		if (count == len) {
+			count = LIBUSB_ERROR_OVERFLOW;
+			break;
+		}
+		ifaces[count++] = iface;
+	}
+
+	closedir(dp);
 	free(sysfs_dir);
-	if (ret < 0)
-		return LIBUSB_ERROR_NO_MEM;
+
+	if (count > 0)
+		usbi_sort_iface_numbers(ifaces, count);
+
+	return count;
+}
+
+int set_sysfs_root(const char *sysfs_root)
+{
+	char *root;
+	int i;
+
+	if (!sysfs_root)
+		sysfs_root = SYSFS_ROOT;
+
+	root = realpath(sysfs_root, NULL);
+	if (!root)
+		return errno == ENOENT ? LIBUSB_ERROR_NOT_FOUND : LIBUSB_ERROR_IO;
+
+	snprintf(sysfs.devices, sizeof(sysfs.devices), "%s" SYSFS_DEVICE_PATH, root);
+	snprintf(sysfs.block, sizeof(sysfs.block), "%s" SYSFS_CLASS_BLOCK, root);
+	snprintf(sysfs.tty, sizeof(sysfs.tty), "%s" SYSFS_CLASS_TTY, root);
+	snprintf(sysfs.uevent_seqnum, sizeof(sysfs.uevent_seqnum),
+		 "%s" SYSFS_UEVENT_SEQNUM, root);
+	free(root);
+
+	/* Entries point into the old tree */
+	pthread_mutex_lock(&neg_cache_lock);
+	for (i = 0; i < NEG_CACHE_SIZE; i++) {
+		free(neg_cache[i].dir);
+		neg_cache[i].dir = NULL;
+	}
+	pthread_mutex_unlock(&neg_cache_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+int get_dev_path_by_name(const char *sysfs_dir, int iface_idx,
+	enum usbi_dev_type dev_type, int walks, char **path)
+{
+	unsigned long long seqnum;
+	int ret, active_config, have_seqnum, vanished, tries;
+	const char *subsystem;
+	char *dir;
 
 	if (dev_type == USBI_DEV_BLOCK)
-		ret = get_subsytem(path, dir, "/sys/class/block", 0);
+		subsystem = sysfs.block;
 	else if(dev_type == USBI_DEV_CHAR)
-		ret = get_subsytem(path, dir, "/sys/class/tty", 0);
+		subsystem = sysfs.tty;
 	else
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	ret = get_active_config(sysfs_dir, &active_config);
+	if (ret < 0)
+		return ret == LIBUSB_ERROR_NO_MEM ? ret : LIBUSB_ERROR_NOT_FOUND;
+
+	ret = asprintf(&dir, "%s/%s:%d.%d", sysfs.devices, sysfs_dir,
+		       active_config, iface_idx);
+	if (ret < 0)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/*
+	 * The sequence number is read before the walk so that a device
+	 * showing up while walking invalidates the result.
+	 */
+	have_seqnum = read_uevent_seqnum(&seqnum) == LIBUSB_SUCCESS;
+
+	if (have_seqnum && neg_cache_lookup(dir, subsystem, seqnum)) {
+		ret = LIBUSB_ERROR_NOT_FOUND;
+	} else {
+		/*
+		 * A miss after entries vanished may just mean the walk raced
+		 * with the node being moved, walk again while the interface
+		 * is still there.
+		 */
 		ret = LIBUSB_ERROR_NOT_FOUND;
+		vanished = 0;
+		for (tries = 0; tries < walks; tries++) {
+			vanished = 0;
+			ret = get_subsytem(path, dir, subsystem, 0, &vanished);
+			if (ret != LIBUSB_ERROR_NOT_FOUND || !vanished ||
+			    access(dir, F_OK) < 0)
+				break;
+		}
+
+		if (ret == LIBUSB_ERROR_NOT_FOUND && !vanished && have_seqnum)
+			neg_cache_store(dir, subsystem, seqnum);
+	}
 	free(dir);
 
 	return ret;
 }
+
+int get_dev_path(struct libusb_device *dev, int iface_idx,
+	enum usbi_dev_type dev_type, char **path)
+{
+	char *sysfs_dir;
+	int ret;
+
+	ret = get_sysfs_name(dev, &sysfs_dir);
+	if (ret < 0)
+		return ret;
+
+	ret = get_dev_path_by_name(sysfs_dir, iface_idx, dev_type,
+				   SYSFS_WALK_RETRIES, path);
+	free(sysfs_dir);
+
+	return ret;
+}
+
+/* Directories under the /dev root holding `by-*` symlink directories */
+static const char *const alias_dirs[] = { "disk", "serial" };
+
+/*
+ * Turn a symlink found in `<dev_root>/<rel_dir>` into a path relative to
+ * dev_root, e.g. `../../sda1` in `disk/by-id` becomes `sda1`.
+ * Returns NULL if the link points outside of dev_root or on error.
+ */
+static char *alias_target(const char *dev_root, const char *rel_dir,
+	const char *link)
+{
+	char *joined, *target, *comp, *save;
+	size_t len = 0, root_len;
+
+	if (link[0] == '/') {
+		root_len = strlen(dev_root);
+		if (!strncmp(link, dev_root, root_len) && link[root_len] == '/')
+			return strdup(link + root_len + 1);
+		return NULL;
+	}
+
+	if (asprintf(&joined, "%s/%s", rel_dir, link) < 0)
+		return NULL;
+
+	target = malloc(strlen(joined) + 1);
+	if (!target) {
+		free(joined);
+		return NULL;
+	}
+	target[0] = '\0';
+
+	for (comp = strtok_r(joined, "/", &save); comp;
+	     comp = strtok_r(NULL, "/", &save)) {
+		if (!strcmp(comp, "."))
+			continue;
+
+		if (!strcmp(comp, "..")) {
+			if (!len)
+				break;
+			while (len && target[len - 1] != '/')
+				len--;
+			if (len)
+				len--;
+			target[len] = '\0';
+			continue;
+		}
+
+		if (len)
+			target[len++] = '/';
+		strcpy(target + len, comp);
+		len += strlen(comp);
+	}
+
+	/* Escaped dev_root or pointed at it */
+	if (comp || !len) {
+		free(joined);
+		free(target);
+		return NULL;
+	}
+
+	free(joined);
+	return target;
+}
+
+static int add_alias(struct usbi_alias **aliases, size_t *count,
+	size_t *alloc, char *target, char *alias)
+{
+	struct usbi_alias *new_aliases;
+
+	if (*count == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 32;
+		new_aliases = realloc(*aliases, *alloc * sizeof(**aliases));
+		if (!new_aliases)
+			return LIBUSB_ERROR_NO_MEM;
+		*aliases = new_aliases;
+	}
+
+	(*aliases)[*count].target = target;
+	(*aliases)[*count].alias = alias;
+	(*count)++;
+
+	return LIBUSB_SUCCESS;
+}
+
+static int scan_alias_dir(const char *dev_root, const char *rel_dir,
+	struct usbi_alias **aliases, size_t *count, size_t *alloc)
+{
+	char link[PATH_MAX];
+	struct dirent *entry;
+	char *dir, *target, *alias;
+	ssize_t len;
+	DIR *dp;
+	int ret = LIBUSB_SUCCESS;
+
+	if (asprintf(&dir, "%s/%s", dev_root, rel_dir) < 0)
+		return LIBUSB_ERROR_NO_MEM;
+
+	dp = opendir(dir);
+	if (!dp) {
+		free(dir);
+		/* Gone since it was listed */
+		return errno == ENOENT ? LIBUSB_SUCCESS : LIBUSB_ERROR_IO;
+	}
+
+	while ((entry = readdir(dp)) != NULL) {
+		if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+			continue;
+
+		len = readlinkat(dirfd(dp), entry->d_name, link, sizeof(link) - 1);
+		if (len < 0)
+			continue;
+		link[len] = '\0';
+
+		target = alias_target(dev_root, rel_dir, link);
+		if (!target)
+			continue;
+
+		if (asprintf(&alias, "%s/%s", dir, entry->d_name) < 0) {
+			free(target);
+			ret = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+
+		ret = add_alias(aliases, count, alloc, target, alias);
+		if (ret < 0) {
+			free(target);
+			free(alias);
+			break;
+		}
+	}
+
+	closedir(dp);
+	free(dir);
+	return ret;
+}
+
+/*
+ * List every symlink in the `<dev_root>/disk/by-*` and
+ * `<dev_root>/serial/by-*` directories along with the node it points to.
+ */
+int get_dev_aliases(const char *dev_root, struct usbi_alias **aliases,
+	size_t *count)
+{
+	struct dirent *entry;
+	char *dir, *rel_dir;
+	size_t i, alloc = 0;
+	DIR *dp;
+	int ret = LIBUSB_SUCCESS;
+
+	if (!dev_root)
+		dev_root = DEV_ROOT;
+
+	*aliases = NULL;
+	*count = 0;
+
+	for (i = 0; ret == LIBUSB_SUCCESS &&
+	     i < sizeof(alias_dirs) / sizeof(alias_dirs[0]); i++) {
+		if (asprintf(&dir, "%s/%s", dev_root, alias_dirs[i]) < 0) {
+			ret = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+
+		dp = opendir(dir);
+		free(dir);
+		if (!dp) {
+			/* No disks or no serial ports */
+			if (errno != ENOENT)
+				ret = LIBUSB_ERROR_IO;
+			continue;
+		}
+
+		while ((entry = readdir(dp)) != NULL) {
+			if (strncmp(entry->d_name, "by-", 3))
+				continue;
+
+			if (asprintf(&rel_dir, "%s/%s", alias_dirs[i],
+				     entry->d_name) < 0) {
+				ret = LIBUSB_ERROR_NO_MEM;
+				break;
+			}
+
+			ret = scan_alias_dir(dev_root, rel_dir, aliases, count, &alloc);
+			free(rel_dir);
+			if (ret < 0)
+				break;
+		}
+
+		closedir(dp);
+	}
+
+	if (ret < 0) {
+		for (i = 0; i < *count; i++) {
+			free((*aliases)[i].target);
+			free((*aliases)[i].alias);
+		}
+		free(*aliases);
+		*aliases = NULL;
+		*count = 0;
+	}
+
+	return ret;
+}
@@ -21,36 +21,110 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 
 #include "libusb.h"
 #include "libusbgetdev.h"
 
-static void print_devs(libusb_device **devs)
-{
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_CSV,
+};
+
+enum dev_event {
+	EVENT_NONE,
+	EVENT_ADD,
+	EVENT_CHANGE,
+	EVENT_REMOVE,
+};
+
+/*
+ * How long a newly plugged device is polled for the nodes that its
+ * interface drivers create after the device itself shows up.
+ */
+#define SETTLE_TIMEOUT_MS 5000
+#define SETTLE_POLL_MS 250
+#define MAX_SETTLING 64
+
+struct settling_dev {
 	libusb_device *dev;
-	int i = 0, j = 0;
+	char *nodes;
+	long long deadline;
+};
+
+static struct settling_dev settling[MAX_SETTLING];
+static int watch_started = 0;
+
+static enum output_format format = FORMAT_TEXT;
+static volatile sig_atomic_t do_exit = 0;
+
+static const char *event_name(enum dev_event event)
+{
+	if (event == EVENT_ADD)
+		return "add";
+	else if (event == EVENT_CHANGE)
+		return "change";
+	else if (event == EVENT_REMOVE)
+		return "remove";
+	return "list";
+}
+
+/* Print a JSON string, or null when there is none. */
+static void print_json_string(const char *str)
+{
+	if (!str) {
+		printf("null");
+		return;
+	}
+
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", (unsigned char)*str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_port_path(libusb_device *dev, const char *sep)
+{
 	uint8_t path[8];
+	int r, j;
+
+	r = libusb_get_port_numbers(dev, path, sizeof(path));
+	if (r <= 0)
+		return;
+
+	printf("%s%d", sep, path[0]);
+	for (j = 1; j < r; j++)
+		printf(".%d", path[j]);
+}
+
+static void print_text(libusb_device *dev, enum dev_event event,
+	struct libusb_device_descriptor *desc)
+{
 	char *blockdev_path, *chardev_path;
 
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		int r = libusb_get_device_descriptor(dev, &desc);
-		if (r < 0) {
-			fprintf(stderr, "failed to get device descriptor");
-			return;
-		}
+	if (event == EVENT_ADD)
+		printf("+ ");
+	else if (event == EVENT_CHANGE)
+		printf("* ");
+	else if (event == EVENT_REMOVE)
+		printf("- ");
 
-		printf("Bus %03d Device %03d: ID: %04x:%04x",
-			libusb_get_bus_number(dev), libusb_get_device_address(dev),
-			desc.idVendor, desc.idProduct);
+	printf("Bus %03d Device %03d: ID: %04x:%04x",
+		libusb_get_bus_number(dev), libusb_get_device_address(dev),
+		desc->idVendor, desc->idProduct);
 
-		r = libusb_get_port_numbers(dev, path, sizeof(path));
-		if (r > 0) {
-			printf(" Path: %d", path[0]);
-			for (j = 1; j < r; j++)
-				printf(".%d", path[j]);
-		}
+	print_port_path(dev, " Path: ");
 
+	/* The device nodes are already gone once a device has left. */
+	if (event != EVENT_REMOVE) {
 		if(!libusb_get_blockdev_path(dev, 0, &blockdev_path))
 			printf(" Blockdev: %s", blockdev_path);
 
@@ -63,20 +137,355 @@ static void print_devs(libusb_device **devs)
 
 		if (chardev_path)
 			free(chardev_path);
-		printf("\n");
 	}
+	printf("\n");
+}
+
+static void print_csv_row(libusb_device *dev, enum dev_event event,
+	struct libusb_device_descriptor *desc, int iface,
+	const char *blockdev_path, const char *chardev_path)
+{
+	printf("%s,%d,%d,%04x,%04x,", event_name(event),
+		libusb_get_bus_number(dev), libusb_get_device_address(dev),
+		desc->idVendor, desc->idProduct);
+	print_port_path(dev, "");
+
+	if (iface < 0)
+		printf(",,,\n");
+	else
+		printf(",%d,%s,%s\n", iface,
+			blockdev_path ? blockdev_path : "",
+			chardev_path ? chardev_path : "");
+}
+
+/*
+ * Print one JSON object (or one CSV row per interface) for the device.
+ * Every interface of the active configuration is probed for nodes.
+ */
+static void print_record(libusb_device *dev, enum dev_event event,
+	struct libusb_device_descriptor *desc)
+{
+	uint8_t ifaces[UINT8_MAX + 1];
+	char *blockdev_path, *chardev_path;
+	int i, iface, count = 0, rows = 0;
+
+	if (format == FORMAT_JSON) {
+		printf("{\"event\":\"%s\",\"bus\":%d,\"address\":%d,"
+			"\"vid\":\"%04x\",\"pid\":\"%04x\",\"path\":\"",
+			event_name(event), libusb_get_bus_number(dev),
+			libusb_get_device_address(dev),
+			desc->idVendor, desc->idProduct);
+		print_port_path(dev, "");
+		printf("\",\"interfaces\":[");
+	}
+
+	if (event != EVENT_REMOVE)
+		count = libusb_get_interface_numbers(dev, ifaces, sizeof(ifaces));
+
+	for (i = 0; i < count; i++) {
+		iface = ifaces[i];
+
+		libusb_get_blockdev_path(dev, iface, &blockdev_path);
+		libusb_get_chardev_path(dev, iface, &chardev_path);
+
+		if (format == FORMAT_JSON) {
+			printf("%s{\"number\":%d,\"blockdev\":",
+				rows ? "," : "", iface);
+			print_json_string(blockdev_path);
+			printf(",\"chardev\":");
+			print_json_string(chardev_path);
+			printf("}");
+		} else {
+			print_csv_row(dev, event, desc, iface,
+				blockdev_path, chardev_path);
+		}
+		rows++;
+
+		free(blockdev_path);
+		free(chardev_path);
+	}
+
+	if (format == FORMAT_JSON)
+		printf("]}\n");
+	else if (!rows)
+		print_csv_row(dev, event, desc, -1, NULL, NULL);
+}
+
+static int print_dev(libusb_device *dev, enum dev_event event)
+{
+	struct libusb_device_descriptor desc;
+	int r = libusb_get_device_descriptor(dev, &desc);
+	if (r < 0) {
+		fprintf(stderr, "failed to get device descriptor");
+		return r;
+	}
+
+	if (format == FORMAT_TEXT)
+		print_text(dev, event, &desc);
+	else
+		print_record(dev, event, &desc);
+
+	fflush(stdout);
+	return LIBUSB_SUCCESS;
+}
+
+static void print_header(void)
+{
+	if (format == FORMAT_CSV)
+		printf("event,bus,address,vid,pid,path,interface,blockdev,chardev\n");
+}
+
+static void print_devs(libusb_device **devs)
+{
+	libusb_device *dev;
+	int i = 0;
+
+	while ((dev = devs[i++]) != NULL) {
+		if (print_dev(dev, EVENT_NONE) < 0)
+			return;
+	}
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int append_nodes(char **nodes, size_t *len, int iface,
+	const char *blockdev_path, const char *chardev_path)
+{
+	const char *block = blockdev_path ? blockdev_path : "";
+	const char *chr = chardev_path ? chardev_path : "";
+	char *new_nodes;
+	int n;
+
+	n = snprintf(NULL, 0, "%d:%s:%s;", iface, block, chr);
+	new_nodes = realloc(*nodes, *len + n + 1);
+	if (!new_nodes)
+		return LIBUSB_ERROR_NO_MEM;
+
+	*nodes = new_nodes;
+	*len += snprintf(*nodes + *len, n + 1, "%d:%s:%s;", iface, block, chr);
+	return LIBUSB_SUCCESS;
+}
+
+/*
+ * Describe the nodes of every interface of the device, so that a change
+ * can be told apart from another poll finding the same nodes.
+ */
+static char *collect_nodes(libusb_device *dev)
+{
+	uint8_t ifaces[UINT8_MAX + 1];
+	char *blockdev_path, *chardev_path, *nodes;
+	size_t len = 0;
+	int i, count, r = LIBUSB_SUCCESS;
+
+	nodes = calloc(1, 1);
+	if (!nodes)
+		return NULL;
+
+	count = libusb_get_interface_numbers(dev, ifaces, sizeof(ifaces));
+	for (i = 0; r == LIBUSB_SUCCESS && i < count; i++) {
+		libusb_get_blockdev_path(dev, ifaces[i], &blockdev_path);
+		libusb_get_chardev_path(dev, ifaces[i], &chardev_path);
+
+		r = append_nodes(&nodes, &len, ifaces[i],
+				 blockdev_path, chardev_path);
+
+		free(blockdev_path);
+		free(chardev_path);
+	}
+
+	if (r != LIBUSB_SUCCESS) {
+		free(nodes);
+		return NULL;
+	}
+
+	return nodes;
+}
+
+static void settle_add(libusb_device *dev)
+{
+	int i;
+
+	for (i = 0; i < MAX_SETTLING; i++) {
+		if (settling[i].dev)
+			continue;
+
+		settling[i].nodes = collect_nodes(dev);
+		if (!settling[i].nodes)
+			return;
+		settling[i].dev = libusb_ref_device(dev);
+		settling[i].deadline = now_ms() + SETTLE_TIMEOUT_MS;
+		return;
+	}
+}
+
+static void settle_release(struct settling_dev *entry)
+{
+	libusb_unref_device(entry->dev);
+	free(entry->nodes);
+	entry->dev = NULL;
+	entry->nodes = NULL;
+}
+
+static void settle_remove(libusb_device *dev)
+{
+	int i;
+
+	for (i = 0; i < MAX_SETTLING; i++) {
+		if (settling[i].dev == dev)
+			settle_release(&settling[i]);
+	}
+}
+
+/*
+ * Resolve the devices that were plugged in recently again and print a
+ * change record for those whose nodes showed up since the last poll.
+ */
+static void settle_poll(void)
+{
+	long long now = now_ms();
+	char *nodes;
+	int i;
+
+	for (i = 0; i < MAX_SETTLING; i++) {
+		if (!settling[i].dev)
+			continue;
+
+		nodes = collect_nodes(settling[i].dev);
+		if (nodes && strcmp(nodes, settling[i].nodes)) {
+			print_dev(settling[i].dev, EVENT_CHANGE);
+			free(settling[i].nodes);
+			settling[i].nodes = nodes;
+			nodes = NULL;
+		}
+		free(nodes);
+
+		if (now >= settling[i].deadline)
+			settle_release(&settling[i]);
+	}
+}
+
+/*
+ * Only the device named in the event is resolved, the rest of the bus
+ * is left alone.
+ */
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx,
+	libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	(void)ctx;
+	(void)user_data;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		print_dev(dev, EVENT_ADD);
+		/* Devices present at startup already have their nodes */
+		if (watch_started)
+			settle_add(dev);
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		settle_remove(dev);
+		print_dev(dev, EVENT_REMOVE);
+	}
+
+	return 0;
+}
+
+static void sigint_handler(int signum)
+{
+	(void)signum;
+	do_exit = 1;
 }
 
-int main(void)
+/*
+ * Stay resident and print the devices present at startup as add events,
+ * followed by add/remove events as devices come and go, and change
+ * events when a new device's nodes appear after it was added.
+ */
+static int watch_devs(void)
+{
+	libusb_hotplug_callback_handle handle;
+	struct timeval tv = { 0, SETTLE_POLL_MS * 1000 };
+	int r, i;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, "hotplug is not supported on this platform\n");
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	r = libusb_hotplug_register_callback(NULL,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_callback, NULL, &handle);
+	if (r < 0) {
+		fprintf(stderr, "failed to register hotplug callback\n");
+		return r;
+	}
+	watch_started = 1;
+
+	signal(SIGINT, sigint_handler);
+	signal(SIGTERM, sigint_handler);
+
+	while (!do_exit) {
+		r = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			break;
+		r = 0;
+
+		settle_poll();
+	}
+
+	libusb_hotplug_deregister_callback(NULL, handle);
+
+	for (i = 0; i < MAX_SETTLING; i++) {
+		if (settling[i].dev)
+			settle_release(&settling[i]);
+	}
+
+	return r;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [--format=text|json|csv] [--watch]\n", argv0);
+}
+
+int main(int argc, char *argv[])
 {
 	libusb_device **devs;
-	int r;
+	int r, i, watch = 0;
 	ssize_t cnt;
 
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--watch")) {
+			watch = 1;
+		} else if (!strcmp(argv[i], "--format=text")) {
+			format = FORMAT_TEXT;
+		} else if (!strcmp(argv[i], "--format=json")) {
+			format = FORMAT_JSON;
+		} else if (!strcmp(argv[i], "--format=csv")) {
+			format = FORMAT_CSV;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
 	r = libusb_init(/*ctx=*/NULL);
 	if (r < 0)
 		return r;
 
+	print_header();
+
+	if (watch) {
+		r = watch_devs();
+		libusb_exit(NULL);
+		return r;
+	}
+
 	cnt = libusb_get_device_list(NULL, &devs);
 	if (cnt < 0){
 		libusb_exit(NULL);
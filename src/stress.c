@@ -0,0 +1,378 @@
+/*
+ * Resolve interfaces of a fixture sysfs tree while another thread keeps
+ * plugging and unplugging parts of it, and report lookup latency and
+ * error counts.
+ *
+ * usage: stress [threads] [seconds]
+ *
+ * The fixture has one device, 1-1, with STRESS_IFACES interfaces:
+ *  - even interfaces keep their block device the whole time, it is only
+ *    moved between host0 and host1 and has siblings come and go. Any
+ *    result but the right path is an error.
+ *  - odd interfaces have their whole host/.../block/sdX tree created and
+ *    deleted, LIBUSB_ERROR_NOT_FOUND is expected while it is gone.
+ * Each run is done once with a single walk per lookup and once with
+ * SYSFS_WALK_RETRIES walks.
+ */
+
+#ifndef __linux__
+#error "stress needs a Linux sysfs layout"
+#endif
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libusb.h"
+#include "libusbgetdev.h"
+#include "libusbgetdevi.h"
+
+#define STRESS_IFACES 8
+#define STRESS_SAMPLES (1 << 20)
+#define STRESS_DEV "1-1"
+
+enum result {
+	RESULT_OK,
+	RESULT_NOT_FOUND,
+	RESULT_IO,
+	RESULT_WRONG,
+	RESULT_OTHER,
+	RESULT_MAX,
+};
+
+static const char *const result_names[RESULT_MAX] = {
+	"ok", "not_found", "io", "wrong", "other",
+};
+
+struct stats {
+	unsigned long long counts[2][RESULT_MAX];
+	unsigned int *samples;
+	size_t num_samples;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int walks;
+	struct stats stats;
+};
+
+/* Kept short so that every fixture path fits in PATH_MAX */
+static char root[256];
+static atomic_int stop;
+static unsigned long long mutations;
+
+/* Fixture state, carried over from one run to the next */
+static int hosts[STRESS_IFACES];
+static int present[STRESS_IFACES];
+
+/* Path of `rest` below interface `iface` of the fixture device */
+static void iface_path(char *path, int iface, const char *rest)
+{
+	snprintf(path, PATH_MAX, "%s/bus/usb/devices/" STRESS_DEV ":1.%d/%s",
+		 root, iface, rest);
+}
+
+static int mkdirs(char *path)
+{
+	char *c;
+
+	for (c = path + strlen(root) + 1; (c = strchr(c, '/')) != NULL; c++) {
+		*c = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*c = '/';
+	}
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int flag,
+	struct FTW *ftw)
+{
+	(void)sb;
+	(void)flag;
+	(void)ftw;
+
+	remove(path);
+	return 0;
+}
+
+static void rm_tree(const char *path)
+{
+	nftw(path, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Create host<n>/target0:0:0/0:0:0:0/block/sd<x> below an interface */
+static int add_node(int iface, int host)
+{
+	char rest[64], path[PATH_MAX], link[PATH_MAX], target[PATH_MAX];
+
+	snprintf(rest, sizeof(rest), "host%d/target0:0:0/0:0:0:0/block/sd%c",
+		 host, 'a' + iface);
+	iface_path(path, iface, rest);
+	if (mkdirs(path) < 0)
+		return -1;
+
+	strcat(rest, "/subsystem");
+	iface_path(link, iface, rest);
+	snprintf(target, sizeof(target), "%s/class/block", root);
+	if (symlink(target, link) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+static int setup_fixture(void)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/class/block", root);
+	if (mkdirs(path) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/class/tty", root);
+	if (mkdirs(path) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/bus/usb/devices/" STRESS_DEV, root);
+	if (mkdirs(path) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path),
+		 "%s/bus/usb/devices/" STRESS_DEV "/bConfigurationValue", root);
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+	fprintf(fp, "1\n");
+	fclose(fp);
+
+	for (i = 0; i < STRESS_IFACES; i++) {
+		iface_path(path, i, "power");
+		if (mkdirs(path) < 0 || add_node(i, 0) < 0)
+			return -1;
+		present[i] = 1;
+	}
+
+	return 0;
+}
+
+static void *mutator_thread(void *arg)
+{
+	char from[PATH_MAX], to[PATH_MAX], path[PATH_MAX];
+	unsigned long long n = 0;
+	int i;
+
+	(void)arg;
+
+	while (!atomic_load(&stop)) {
+		i = n % STRESS_IFACES;
+
+		if (i % 2 == 0) {
+			/* Move the node, it never stops existing */
+			iface_path(from, i, hosts[i] ? "host1" : "host0");
+			iface_path(to, i, hosts[i] ? "host0" : "host1");
+			if (!rename(from, to))
+				hosts[i] = !hosts[i];
+		} else if (present[i]) {
+			iface_path(path, i, "host0");
+			rm_tree(path);
+			present[i] = 0;
+		} else {
+			add_node(i, 0);
+			present[i] = 1;
+		}
+
+		/* Siblings that vanish while being walked */
+		iface_path(path, i, n % 2 ? "ep_81" : "ep_81/power");
+		if (n % 2)
+			rm_tree(path);
+		else
+			mkdirs(path);
+
+		n++;
+	}
+
+	mutations = n;
+	return NULL;
+}
+
+static unsigned int elapsed_ns(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000000U +
+	       (end.tv_nsec - start->tv_nsec);
+}
+
+static void *lookup_thread(void *arg)
+{
+	struct worker *worker = arg;
+	struct stats *stats = &worker->stats;
+	struct timespec start;
+	char expected[32];
+	unsigned int ns;
+	unsigned long long n = worker->id;
+	enum result result;
+	char *path;
+	int iface, ret;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		iface = n++ % STRESS_IFACES;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = get_dev_path_by_name(STRESS_DEV, iface, USBI_DEV_BLOCK,
+					   worker->walks, &path);
+		ns = elapsed_ns(&start);
+
+		snprintf(expected, sizeof(expected), "/dev/sd%c", 'a' + iface);
+		if (ret == LIBUSB_SUCCESS)
+			result = strcmp(path, expected) ? RESULT_WRONG : RESULT_OK;
+		else if (ret == LIBUSB_ERROR_NOT_FOUND)
+			result = RESULT_NOT_FOUND;
+		else if (ret == LIBUSB_ERROR_IO)
+			result = RESULT_IO;
+		else
+			result = RESULT_OTHER;
+		if (ret == LIBUSB_SUCCESS)
+			free(path);
+
+		stats->counts[iface % 2][result]++;
+		if (stats->num_samples < STRESS_SAMPLES)
+			stats->samples[stats->num_samples++] = ns;
+	}
+
+	return NULL;
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int ua = *(const unsigned int *)a, ub = *(const unsigned int *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static int run(int threads, double seconds, int walks)
+{
+	struct timespec duration;
+	struct worker *workers;
+	struct stats total = { 0 };
+	pthread_t mutator;
+	size_t i, j, k;
+	int ret = 0;
+
+	workers = calloc(threads, sizeof(*workers));
+	total.samples = malloc(threads * STRESS_SAMPLES * sizeof(*total.samples));
+	if (!workers || !total.samples) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < (size_t)threads; i++) {
+		workers[i].stats.samples = malloc(STRESS_SAMPLES *
+						  sizeof(*workers[i].stats.samples));
+		if (!workers[i].stats.samples) {
+			ret = -1;
+			goto out;
+		}
+		workers[i].id = i;
+		workers[i].walks = walks;
+	}
+
+	atomic_store(&stop, 0);
+	pthread_create(&mutator, NULL, mutator_thread, NULL);
+	for (i = 0; i < (size_t)threads; i++)
+		pthread_create(&workers[i].thread, NULL, lookup_thread, &workers[i]);
+
+	duration.tv_sec = (time_t)seconds;
+	duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1e9);
+	nanosleep(&duration, NULL);
+	atomic_store(&stop, 1);
+
+	pthread_join(mutator, NULL);
+	for (i = 0; i < (size_t)threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		for (j = 0; j < 2; j++)
+			for (k = 0; k < RESULT_MAX; k++)
+				total.counts[j][k] += workers[i].stats.counts[j][k];
+		memcpy(total.samples + total.num_samples, workers[i].stats.samples,
+		       workers[i].stats.num_samples * sizeof(*total.samples));
+		total.num_samples += workers[i].stats.num_samples;
+	}
+
+	qsort(total.samples, total.num_samples, sizeof(*total.samples), cmp_uint);
+
+	printf("walks %d, %llu mutations, p50 %.1f us, p99 %.1f us\n", walks,
+	       mutations,
+	       total.num_samples ? total.samples[total.num_samples / 2] / 1e3 : 0,
+	       total.num_samples ? total.samples[total.num_samples * 99 / 100] / 1e3 : 0);
+	for (j = 0; j < 2; j++) {
+		printf("  %-8s", j ? "churned" : "moved");
+		for (k = 0; k < RESULT_MAX; k++)
+			printf(" %s %llu", result_names[k], total.counts[j][k]);
+		printf("\n");
+	}
+
+out:
+	for (i = 0; workers && i < (size_t)threads; i++)
+		free(workers[i].stats.samples);
+	free(workers);
+	free(total.samples);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpl[] = "/tmp/usbgetdev-stress.XXXXXX";
+	char resolved[PATH_MAX];
+	double seconds = 2.0;
+	int threads = 4, ret;
+
+	if (argc > 1)
+		threads = atoi(argv[1]);
+	if (argc > 2)
+		seconds = atof(argv[2]);
+	if (threads < 1 || seconds <= 0) {
+		fprintf(stderr, "usage: stress [threads] [seconds]\n");
+		return 1;
+	}
+
+	if (!mkdtemp(tmpl) || !realpath(tmpl, resolved) ||
+	    strlen(resolved) >= sizeof(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	strcpy(root, resolved);
+
+	ret = setup_fixture();
+	if (!ret)
+		ret = libusbgetdev_set_sysfs_root(root);
+	if (ret) {
+		fprintf(stderr, "could not set up the fixture in %s\n", root);
+	} else {
+		printf("%d lookup threads, %.1f s per run, fixture %s\n",
+		       threads, seconds, root);
+		ret = run(threads, seconds, 1);
+		if (!ret)
+			ret = run(threads, seconds, SYSFS_WALK_RETRIES);
+	}
+
+	rm_tree(root);
+	return ret ? 1 : 0;
+}
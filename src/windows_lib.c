@@ -36,9 +36,16 @@ static int get_devid(struct libusb_device *dev, char **DeviceID)
 int get_dev_path(struct libusb_device *dev, int iface_idx,
 	enum usbi_dev_type dev_type, char **path)
 {
+	uint8_t ifaces[UINT8_MAX + 1];
 	char *DeviceID;
+	int i, count;
 
-	(void)iface_idx;
+	/* The lookup below is per device, only check the interface exists */
+	count = get_iface_numbers(dev, ifaces, sizeof(ifaces));
+	for (i = 0; i < count && ifaces[i] != iface_idx; i++)
+		;
+	if (i >= count)
+		return LIBUSB_ERROR_NOT_FOUND;
 
 	if (get_devid(dev, &DeviceID) != LIBUSB_SUCCESS)
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -46,6 +53,29 @@ int get_dev_path(struct libusb_device *dev, int iface_idx,
 	return match_dev_path(dev_type, DeviceID, path);
 }
 
+int get_dev_aliases(const char *dev_root, struct usbi_alias **aliases,
+	size_t *count)
+{
+	(void)dev_root;
+
+	*aliases = NULL;
+	*count = 0;
+
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int get_iface_numbers(struct libusb_device *dev, uint8_t *ifaces, int len)
+{
+	return usbi_get_iface_numbers_from_config(dev, ifaces, len);
+}
+
+int set_sysfs_root(const char *sysfs_root)
+{
+	(void)sysfs_root;
+
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 static int match_dev_path(enum usbi_dev_type dev_type, const char *DeviceID, char **path) {
 	HDEVINFO device_info_set;
 	SP_DEVINFO_DATA device_info_data;